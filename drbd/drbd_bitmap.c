@@ -1426,6 +1426,33 @@ unsigned long drbd_bm_find_next(struct drbd_peer_device *peer_device, unsigned l
 		     BM_OP_FIND_BIT, NULL);
 }
 
+/* Find the next run of set bits at or after start, but at most max_len bits
+ * long. Returns the first bit of the run and stores its length in *len, or
+ * returns DRBD_END_OF_BITMAP. Searches word by word, in one go under the
+ * bitmap lock, instead of testing bit by bit. */
+unsigned long drbd_bm_find_next_run(struct drbd_peer_device *peer_device, unsigned long start,
+				    unsigned long max_len, unsigned long *len)
+{
+	struct drbd_device *device = peer_device->device;
+	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned int bitmap_index = peer_device->bitmap_index;
+	unsigned long irq_flags;
+	unsigned long first, zero;
+
+	*len = 0;
+	spin_lock_irqsave(&bitmap->bm_lock, irq_flags);
+	first = __bm_op(device, bitmap_index, start, -1UL, BM_OP_FIND_BIT, NULL);
+	if (first < bitmap->bm_bits) {
+		unsigned long last = min(first + max_len, bitmap->bm_bits) - 1;
+
+		zero = __bm_op(device, bitmap_index, first + 1, last, BM_OP_FIND_ZERO_BIT, NULL);
+		*len = (zero == DRBD_END_OF_BITMAP ? last + 1 : zero) - first;
+	}
+	spin_unlock_irqrestore(&bitmap->bm_lock, irq_flags);
+
+	return first;
+}
+
 #if 0
 /* not yet needed for anything. */
 unsigned long drbd_bm_find_next_zero(struct drbd_peer_device *peer_device, unsigned long start)
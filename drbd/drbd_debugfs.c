@@ -794,12 +794,13 @@ static int connection_transport_show(struct seq_file *m, void *ignored)
 	struct drbd_transport_ops *tr_ops = transport->ops;
 	enum drbd_stream i;
 
-	seq_printf(m, "v: %u\n\n", 0);
+	seq_printf(m, "v: %u\n\n", 1);
 
 	for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
 		struct drbd_send_buffer *sbuf = &connection->send_buffer[i];
 		seq_printf(m, "%s stream\n", i == DATA_STREAM ? "data" : "control");
 		seq_printf(m, "  corked: %d\n", test_bit(CORKED + i, &connection->flags));
+		seq_printf(m, "  buffer: %lu bytes\n", PAGE_SIZE << sbuf->order);
 		seq_printf(m, "  unsent: %ld bytes\n", (long)(sbuf->pos - sbuf->unsent));
 		seq_printf(m, "  allocated: %d bytes\n", sbuf->allocated_size);
 	}
@@ -1368,6 +1369,28 @@ static int peer_device_resync_extents_show(struct seq_file *m, void *ignored)
 	return 0;
 }
 
+static int peer_device_resync_controller_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_peer_device *peer_device = m->private;
+	struct fifo_buffer *plan;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	rcu_read_lock();
+	plan = rcu_dereference(peer_device->rs_plan_s);
+	seq_printf(m, "controller: %s\n",
+		   !plan->size ? "fixed" : DRBD_RS_DELAY_BASED ? "delay" : "plan-ahead");
+	seq_printf(m, "sync rate: %d KiB/s\n", peer_device->c_sync_rate);
+	seq_printf(m, "in flight: %d sectors\n", peer_device->rs_in_flight);
+	seq_printf(m, "planned: %d sectors\n", plan->total);
+	rcu_read_unlock();
+	seq_printf(m, "window: %u sectors\n", peer_device->rs_ctl_window);
+	seq_printf(m, "latency: %u us\n", peer_device->rs_ctl_lat);
+	seq_printf(m, "base latency: %u us\n", peer_device->rs_ctl_lat_base);
+	return 0;
+}
+
 static void seq_printf_with_thousands_grouping(struct seq_file *seq, long v)
 {
 	/* v is in kB/sec. We don't expect TiByte/sec yet. */
@@ -1661,6 +1684,7 @@ static const struct file_operations peer_device_ ## name ## _fops = {		\
 
 drbd_debugfs_peer_device_attr(resync_extents)
 drbd_debugfs_peer_device_attr(proc_drbd)
+drbd_debugfs_peer_device_attr(resync_controller)
 
 void drbd_debugfs_peer_device_add(struct drbd_peer_device *peer_device)
 {
@@ -1680,6 +1704,7 @@ void drbd_debugfs_peer_device_add(struct drbd_peer_device *peer_device)
 	/* debugfs create file */
 	peer_dev_dcf(resync_extents);
 	peer_dev_dcf(proc_drbd);
+	peer_dev_dcf(resync_controller);
 	return;
 
 fail:
@@ -1689,6 +1714,7 @@ fail:
 
 void drbd_debugfs_peer_device_cleanup(struct drbd_peer_device *peer_device)
 {
+	drbd_debugfs_remove(&peer_device->debugfs_peer_dev_resync_controller);
 	drbd_debugfs_remove(&peer_device->debugfs_peer_dev_proc_drbd);
 	drbd_debugfs_remove(&peer_device->debugfs_peer_dev_resync_extents);
 	drbd_debugfs_remove(&peer_device->debugfs_peer_dev);
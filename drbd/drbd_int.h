@@ -88,6 +88,30 @@
 extern unsigned int drbd_minor_count;
 extern unsigned int drbd_protocol_version_min;
 
+/* Compile time tuning of the data path.  These are no module parameters,
+ * they are to become resource options once drbd_genl.h and drbdsetup
+ * know about them.  Override at build time, e.g. with
+ * make KCPPFLAGS=-DDRBD_READ_STRIPE_KB=64 */
+#ifndef DRBD_READ_STRIPE_KB
+#define DRBD_READ_STRIPE_KB 128 /* split remote reads over UpToDate peers, 0 = off */
+#endif
+#ifndef DRBD_RS_DELAY_BASED
+#define DRBD_RS_DELAY_BASED 0 /* with c-plan-ahead, use drbd_rs_delay_controller() */
+#endif
+#ifndef DRBD_SEND_BUFFER_KB
+#define DRBD_SEND_BUFFER_KB 32 /* per stream send buffer, 4 - 1024 */
+#endif
+#ifndef DRBD_ACK_DELAY_MS
+#define DRBD_ACK_DELAY_MS 0 /* collect acks this long before sending, 0 = off */
+#endif
+#define DRBD_ACK_DELAY_MAX_MS 100
+#ifndef DRBD_ACK_BATCH
+#define DRBD_ACK_BATCH 32 /* send delayed acks once this many are pending */
+#endif
+#ifndef DRBD_SENDER_REQ_BATCH
+#define DRBD_SENDER_REQ_BATCH 8 /* requests sent before each sender work item */
+#endif
+
 #ifdef CONFIG_DRBD_FAULT_INJECTION
 extern int drbd_enable_faults;
 extern int drbd_fault_rate;
@@ -412,6 +436,17 @@ struct digest_info {
 	void *digest;
 };
 
+/* Digest of the local data of a checksum based resync or online verify
+ * read, computed on drbd_csum_wq before the sender gets the request */
+struct drbd_peer_req_csum {
+	struct work_struct work;
+	struct drbd_peer_request *peer_req;
+	struct crypto_ahash *tfm; /* valid until the work is done, see drbd_replace_csum_tfm() */
+	unsigned int tfm_gen; /* connection->csum_tfm_gen when tfm was picked */
+	unsigned int size;
+	u8 digest[];
+};
+
 struct drbd_peer_request {
 	struct drbd_work w;
 	struct drbd_peer_device *peer_device;
@@ -427,7 +462,10 @@ struct drbd_peer_request {
 	unsigned long flags;	/* see comments on ee flag bits below */
 	union {
 		struct { /* regular peer_request */
-			struct drbd_epoch *epoch; /* for writes */
+			union {
+				struct drbd_epoch *epoch; /* for writes */
+				struct drbd_peer_req_csum *csum; /* if EE_HAS_CSUM */
+			};
 			unsigned long submit_jif;
 			union {
 				u64 block_id;
@@ -511,6 +549,15 @@ enum {
 
 	/* Hold reference in activity log */
 	__EE_IN_ACTLOG,
+
+	/* This read has a pointer to a struct drbd_peer_req_csum */
+	__EE_HAS_CSUM,
+
+	/* Read for checksum based resync, its data is hashed with csums_tfm */
+	__EE_CSUM_RS,
+
+	/* Read for online verify, its data is hashed with verify_tfm */
+	__EE_CSUM_OV,
 };
 #define EE_MAY_SET_IN_SYNC     (1<<__EE_MAY_SET_IN_SYNC)
 #define EE_SET_OUT_OF_SYNC     (1<<__EE_SET_OUT_OF_SYNC)
@@ -529,6 +576,9 @@ enum {
 #define EE_APPLICATION		(1<<__EE_APPLICATION)
 #define EE_RS_THIN_REQ		(1<<__EE_RS_THIN_REQ)
 #define EE_IN_ACTLOG		(1<<__EE_IN_ACTLOG)
+#define EE_HAS_CSUM		(1<<__EE_HAS_CSUM)
+#define EE_CSUM_RS		(1<<__EE_CSUM_RS)
+#define EE_CSUM_OV		(1<<__EE_CSUM_OV)
 
 /* flag bits per device */
 enum {
@@ -826,9 +876,11 @@ struct drbd_thread_timing_details
 #define DRBD_THREAD_DETAILS_HIST	16
 
 struct drbd_send_buffer {
-	struct page *page;  /* current buffer page for sending data */
+	struct page *page;  /* current buffer (compound) page for sending data */
+	unsigned int order; /* the buffer spans 1 << order pages */
+	unsigned long retry_order_jif; /* after a fallback, keep order until then */
 	char *unsent;  /* start of unsent area != pos if corked... */
-	char *pos; /* position within that page */
+	char *pos; /* position within the whole buffer, may be past the first page */
 	int allocated_size; /* currently allocated space */
 	int additional_size;  /* additional space to be added to next packet's size */
 };
@@ -959,6 +1011,7 @@ struct drbd_connection {
 	struct crypto_ahash *peer_integrity_tfm;  /* checksums we verify, only accessed from receiver thread  */
 	struct crypto_ahash *csums_tfm;
 	struct crypto_ahash *verify_tfm;
+	unsigned int csum_tfm_gen; /* bumped whenever one of the two above is replaced */
 
 	void *int_dig_in;
 	void *int_dig_vv;
@@ -987,7 +1040,7 @@ struct drbd_connection {
 	struct list_head net_ee;    /* zero-copy network send in progress */
 	struct list_head done_ee;   /* need to send P_WRITE_ACK */
 	atomic_t done_ee_cnt;
-	struct work_struct send_acks_work;
+	struct delayed_work send_acks_work;
 	wait_queue_head_t ee_wait;
 
 	atomic_t pp_in_use;		/* allocated from page pool */
@@ -1172,6 +1225,10 @@ struct drbd_peer_device {
 	int rs_last_events;  /* counter of read or write "events" (unit sectors)
 			      * on the lower level device when we last looked. */
 	int rs_in_flight; /* resync sectors in flight (to proxy, in proxy and from proxy) */
+	unsigned int rs_ctl_window; /* delay based controller: sectors to keep in flight */
+	unsigned int rs_ctl_lat;      /* last resync latency in us */
+	unsigned int rs_ctl_lat_base; /* lowest resync latency in us, slowly aging */
+	ktime_t rs_ctl_last;          /* when the delay based controller last ran */
 	unsigned long ov_left; /* in bits */
 	unsigned long ov_skipped; /* in bits */
 
@@ -1189,6 +1246,7 @@ struct drbd_peer_device {
 	struct dentry *debugfs_peer_dev;
 	struct dentry *debugfs_peer_dev_resync_extents;
 	struct dentry *debugfs_peer_dev_proc_drbd;
+	struct dentry *debugfs_peer_dev_resync_controller;
 #endif
 	ktime_t pre_send_kt;
 	ktime_t acked_kt;
@@ -1286,6 +1344,8 @@ struct drbd_device {
 	/* Interval trees of pending local requests */
 	struct rb_root read_requests;
 	struct rb_root write_requests;
+	/* cheap "certainly no overlap" check for write_requests */
+	struct drbd_interval_filter write_requests_filter;
 
 	/* for statistics and timeouts */
 	/* [0] read, [1] write */
@@ -1732,6 +1792,24 @@ static inline int interval_to_al_extents(struct drbd_interval *i)
 	return 1 + last - first; /* worst case: all touched extends are cold. */
 }
 
+/* must hold resource->req_lock */
+static inline void drbd_insert_write_interval(struct drbd_device *device,
+					      struct drbd_interval *i)
+{
+	drbd_insert_interval(&device->write_requests, i);
+	drbd_interval_filter_add(&device->write_requests_filter, i);
+}
+
+/* must hold resource->req_lock */
+static inline void drbd_remove_write_interval(struct drbd_device *device,
+					      struct drbd_interval *i)
+{
+	if (drbd_interval_empty(i))
+		return;
+	drbd_remove_interval(&device->write_requests, i);
+	drbd_interval_filter_del(&device->write_requests_filter, i);
+}
+
 extern struct drbd_bitmap *drbd_bm_alloc(void);
 extern int  drbd_bm_resize(struct drbd_device *device, sector_t sectors, bool set_new_bits);
 void drbd_bm_free(struct drbd_bitmap *bitmap);
@@ -1762,6 +1840,8 @@ extern sector_t      drbd_bm_capacity(struct drbd_device *device);
 
 #define DRBD_END_OF_BITMAP	(~(unsigned long)0)
 extern unsigned long drbd_bm_find_next(struct drbd_peer_device *, unsigned long);
+extern unsigned long drbd_bm_find_next_run(struct drbd_peer_device *, unsigned long,
+					   unsigned long, unsigned long *);
 /* bm_find_next variants for use while you hold drbd_bm_lock() */
 extern unsigned long _drbd_bm_find_next(struct drbd_peer_device *, unsigned long);
 extern unsigned long _drbd_bm_find_next_zero(struct drbd_peer_device *, unsigned long);
@@ -1788,6 +1868,9 @@ extern struct kmem_cache *drbd_al_ext_cache;	/* activity log extents */
 extern DRBD_MEMPOOL_T drbd_request_mempool;
 extern DRBD_MEMPOOL_T drbd_ee_mempool;
 
+/* hashes resync and online verify reads, see drbd_endio_read_sec_final() */
+extern struct workqueue_struct *drbd_csum_wq;
+
 /* drbd's page pool, used to buffer data received from the peer,
  * or data requested by the peer.
  *
@@ -1822,6 +1905,8 @@ extern struct bio *bio_alloc_drbd(gfp_t gfp_mask);
 
 /* And a bio_set for cloning */
 extern struct DRBD_BIO_SET drbd_io_bio_set;
+/* ... and one for splitting remote reads into stripes */
+extern struct DRBD_BIO_SET drbd_read_split_bio_set;
 
 extern int conn_lowest_minor(struct drbd_connection *connection);
 extern struct drbd_peer_device *create_peer_device(struct drbd_device *, struct drbd_connection *);
@@ -1942,6 +2027,7 @@ static inline void ov_skipped_print(struct drbd_peer_device *peer_device)
 
 extern void drbd_csum_bio(struct crypto_ahash *, struct bio *, void *);
 extern void drbd_csum_pages(struct crypto_ahash *, struct page *, void *);
+extern void drbd_replace_csum_tfm(struct drbd_connection *, struct crypto_ahash **, struct crypto_ahash *);
 /* worker callbacks */
 extern int w_e_end_data_req(struct drbd_work *, int);
 extern int w_e_end_rsdata_req(struct drbd_work *, int);
@@ -2019,6 +2105,7 @@ extern int drbd_send_ack_ex(struct drbd_peer_device *, enum drbd_packet,
 extern int drbd_receiver(struct drbd_thread *thi);
 extern int drbd_ack_receiver(struct drbd_thread *thi);
 extern void drbd_send_ping_wf(struct work_struct *ws);
+extern void drbd_queue_send_acks(struct drbd_connection *connection, bool now);
 extern void drbd_send_acks_wf(struct work_struct *ws);
 extern void drbd_send_peer_ack_wf(struct work_struct *ws);
 extern bool drbd_rs_c_min_rate_throttle(struct drbd_peer_device *);
@@ -2373,6 +2460,20 @@ drbd_queue_work_if_unqueued(struct drbd_work_queue *q, struct drbd_work *w)
 	wake_up(&q->q_wait);
 }
 
+/* Account resync replies on the SyncTarget. With the delay based controller,
+ * replies clock the resync: once half of the window came back, generate the
+ * next requests right away instead of waiting for the resync timer. */
+static inline void drbd_rs_sect_in(struct drbd_peer_device *peer_device, unsigned int sectors)
+{
+	unsigned int window = READ_ONCE(peer_device->rs_ctl_window);
+	int sect_in = atomic_add_return(sectors, &peer_device->rs_sect_in);
+
+	if (DRBD_RS_DELAY_BASED && window && sect_in >= window / 2 &&
+	    peer_device->repl_state[NOW] == L_SYNC_TARGET)
+		drbd_queue_work_if_unqueued(&peer_device->connection->sender_work,
+					    &peer_device->resync_work);
+}
+
 static inline void
 drbd_device_post_work(struct drbd_device *device, int work_bit)
 {
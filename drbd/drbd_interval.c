@@ -1,6 +1,27 @@
 #include "drbd_interval.h"
 #include "drbd_wrappers.h"
 
+/* Since 3.5, the rbtree core takes augment callbacks and only propagates
+ * "end" upwards as long as it actually changes.  The older
+ * rb_augment_insert()/rb_augment_erase_end() interface recomputes every
+ * node up to the root, touching (and missing in the cache on) the whole
+ * path on each insert and erase.  Prefer the new interface where we have it.
+ * Look for its header rather than at the version, distribution kernels
+ * backport it; compilers without __has_include are as old as the kernels
+ * lacking it, for them the version has to do.
+ */
+#if defined(__has_include)
+#if __has_include(<linux/rbtree_augmented.h>)
+#define DRBD_RBTREE_AUGMENTED_CALLBACKS
+#endif
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(3,5,0)
+#define DRBD_RBTREE_AUGMENTED_CALLBACKS
+#endif
+
+#ifdef DRBD_RBTREE_AUGMENTED_CALLBACKS
+#include <linux/rbtree_augmented.h>
+#endif
+
 /**
  * interval_end  -  return end of @node
  */
@@ -11,6 +32,44 @@ sector_t interval_end(struct rb_node *node)
 	return this->end;
 }
 
+/**
+ * interval_sector_end  -  first sector after @this (exclusive end)
+ */
+static inline
+sector_t interval_sector_end(struct drbd_interval *this)
+{
+	return this->sector + (this->size >> 9);
+}
+
+#ifdef DRBD_RBTREE_AUGMENTED_CALLBACKS
+/* Since 5.3, RB_DECLARE_CALLBACKS() takes a different set of arguments, and
+ * RB_DECLARE_CALLBACKS_MAX() computes the subtree maximum for us. */
+#ifdef RB_DECLARE_CALLBACKS_MAX
+RB_DECLARE_CALLBACKS_MAX(static, augment_callbacks, struct drbd_interval, rb,
+			 sector_t, end, interval_sector_end);
+#else
+static inline
+sector_t compute_subtree_end(struct drbd_interval *this)
+{
+	sector_t end = interval_sector_end(this);
+
+	if (this->rb.rb_left) {
+		sector_t left = interval_end(this->rb.rb_left);
+		if (left > end)
+			end = left;
+	}
+	if (this->rb.rb_right) {
+		sector_t right = interval_end(this->rb.rb_right);
+		if (right > end)
+			end = right;
+	}
+	return end;
+}
+
+RB_DECLARE_CALLBACKS(static, augment_callbacks, struct drbd_interval, rb,
+		     sector_t, end, compute_subtree_end);
+#endif
+#else
 /**
  * update_interval_end  -  recompute end of @node
  *
@@ -37,6 +96,7 @@ update_interval_end(struct rb_node *node, void *__unused)
 	}
 	this->end = end;
 }
+#endif
 
 /**
  * drbd_insert_interval  -  insert a new interval into a tree
@@ -45,6 +105,7 @@ bool
 drbd_insert_interval(struct rb_root *root, struct drbd_interval *this)
 {
 	struct rb_node **new = &root->rb_node, *parent = NULL;
+	sector_t this_end = interval_sector_end(this);
 
 	BUG_ON(!IS_ALIGNED(this->size, 512));
 
@@ -53,6 +114,12 @@ drbd_insert_interval(struct rb_root *root, struct drbd_interval *this)
 			rb_entry(*new, struct drbd_interval, rb);
 
 		parent = *new;
+#ifdef DRBD_RBTREE_AUGMENTED_CALLBACKS
+		/* fix up "end" on the way down, rather than walking
+		 * back up from the new leaf afterwards */
+		if (here->end < this_end)
+			here->end = this_end;
+#endif
 		if (this->sector < here->sector)
 			new = &(*new)->rb_left;
 		else if (this->sector > here->sector)
@@ -65,9 +132,14 @@ drbd_insert_interval(struct rb_root *root, struct drbd_interval *this)
 			return false;
 	}
 
+	this->end = this_end;
 	rb_link_node(&this->rb, parent, new);
+#ifdef DRBD_RBTREE_AUGMENTED_CALLBACKS
+	rb_insert_augmented(&this->rb, root, &augment_callbacks);
+#else
 	rb_insert_color(&this->rb, root);
 	rb_augment_insert(&this->rb, update_interval_end, NULL);
+#endif
 	return true;
 }
 
@@ -111,15 +183,21 @@ drbd_contains_interval(struct rb_root *root, sector_t sector,
 void
 drbd_remove_interval(struct rb_root *root, struct drbd_interval *this)
 {
+#ifndef DRBD_RBTREE_AUGMENTED_CALLBACKS
 	struct rb_node *deepest;
+#endif
 
 	/* avoid endless loop */
 	if (drbd_interval_empty(this))
 		return;
 
+#ifdef DRBD_RBTREE_AUGMENTED_CALLBACKS
+	rb_erase_augmented(&this->rb, root, &augment_callbacks);
+#else
 	deepest = rb_augment_erase_begin(&this->rb);
 	rb_erase(&this->rb, root);
 	rb_augment_erase_end(deepest, update_interval_end, NULL);
+#endif
 }
 
 /**
@@ -151,7 +229,7 @@ drbd_find_overlap(struct rb_root *root, sector_t sector, unsigned int size)
 			/* Overlap if any must be on left side */
 			node = node->rb_left;
 		} else if (here->sector < end &&
-			   sector < here->sector + (here->size >> 9)) {
+			   sector < interval_sector_end(here)) {
 			overlap = here;
 			break;
 		} else if (sector >= here->sector) {
@@ -176,7 +254,76 @@ drbd_next_overlap(struct drbd_interval *i, sector_t sector, unsigned int size)
 		i = rb_entry(node, struct drbd_interval, rb);
 		if (i->sector >= end)
 			return NULL;
-		if (sector < i->sector + (i->size >> 9))
+		if (sector < interval_sector_end(i))
 			return i;
 	}
 }
+
+static void
+filter_extents(sector_t sector, unsigned int size,
+	       unsigned long *first, unsigned long *last)
+{
+	sector_t end = sector + (size >> 9);
+
+	*first = sector >> (DRBD_IFILTER_EXTENT_SHIFT - 9);
+	*last = size ? (end - 1) >> (DRBD_IFILTER_EXTENT_SHIFT - 9) : *first;
+}
+
+static void
+filter_update(struct drbd_interval_filter *f, struct drbd_interval *i, int d)
+{
+	unsigned long ext, first, last;
+
+	filter_extents(i->sector, i->size, &first, &last);
+	if (last - first >= DRBD_IFILTER_BUCKETS) {
+		WRITE_ONCE(f->wide, f->wide + d);
+		return;
+	}
+	for (ext = first; ext <= last; ext++) {
+		unsigned int *c = &f->count[ext % DRBD_IFILTER_BUCKETS];
+		WRITE_ONCE(*c, *c + d);
+	}
+}
+
+/**
+ * drbd_interval_filter_add  -  account for @i being inserted into the tree
+ */
+void
+drbd_interval_filter_add(struct drbd_interval_filter *f, struct drbd_interval *i)
+{
+	filter_update(f, i, 1);
+}
+
+/**
+ * drbd_interval_filter_del  -  account for @i being removed from the tree
+ */
+void
+drbd_interval_filter_del(struct drbd_interval_filter *f, struct drbd_interval *i)
+{
+	filter_update(f, i, -1);
+}
+
+/**
+ * drbd_interval_filter_may_overlap  -  may the tree contain an overlap with [sector, sector + size)?
+ *
+ * Returns false only if there can not possibly be an overlapping interval in
+ * the tree.  If it returns true, the caller has to look at the tree itself.
+ */
+bool
+drbd_interval_filter_may_overlap(struct drbd_interval_filter *f,
+				 sector_t sector, unsigned int size)
+{
+	unsigned long ext, first, last;
+
+	if (READ_ONCE(f->wide))
+		return true;
+
+	filter_extents(sector, size, &first, &last);
+	if (last - first >= DRBD_IFILTER_BUCKETS)
+		return true;
+	for (ext = first; ext <= last; ext++) {
+		if (READ_ONCE(f->count[ext % DRBD_IFILTER_BUCKETS]))
+			return true;
+	}
+	return false;
+}
@@ -67,4 +67,28 @@ extern struct drbd_interval *drbd_next_overlap(struct drbd_interval *, sector_t,
 	     i;							\
 	     i = drbd_next_overlap(i, sector, size))
 
+/*
+ * Conflict filter for an interval tree: count the intervals in the tree per
+ * (hashed) 4 MiB extent of the device.  If none of the buckets covering a
+ * range is in use, nothing in the tree can overlap with that range, and we
+ * can skip the tree walk.  Intervals spanning more extents than there are
+ * buckets are only counted in "wide", which makes every lookup a "maybe".
+ *
+ * Callers serialize updates (req_lock); lookups may be done without it.
+ */
+#define DRBD_IFILTER_EXTENT_SHIFT	22
+#define DRBD_IFILTER_BUCKETS		256
+
+struct drbd_interval_filter {
+	unsigned int wide;
+	unsigned int count[DRBD_IFILTER_BUCKETS];
+};
+
+extern void drbd_interval_filter_add(struct drbd_interval_filter *,
+				     struct drbd_interval *);
+extern void drbd_interval_filter_del(struct drbd_interval_filter *,
+				     struct drbd_interval *);
+extern bool drbd_interval_filter_may_overlap(struct drbd_interval_filter *,
+					     sector_t, unsigned int);
+
 #endif  /* __DRBD_INTERVAL_H */
@@ -162,6 +162,7 @@ DRBD_MEMPOOL_T drbd_ee_mempool;
 DRBD_MEMPOOL_T drbd_md_io_page_pool;
 struct DRBD_BIO_SET drbd_md_io_bio_set;
 struct DRBD_BIO_SET drbd_io_bio_set;
+struct DRBD_BIO_SET drbd_read_split_bio_set;
 
 /* I do not use a standard mempool, because:
    1) I want to hand out the pre-allocated objects first.
@@ -952,20 +953,62 @@ static void prepare_header(struct drbd_connection *connection, int vnr,
 		prepare_header80(buffer, cmd, size);
 }
 
+/* Small packets are collected in a per stream send buffer, and go out
+ * with a single send when it fills up or when the stream gets uncorked. */
+static unsigned int send_buffer_order(void)
+{
+	return get_order(clamp(DRBD_SEND_BUFFER_KB, 4, 1024) << 10);
+}
+
+/* Higher order pages are not always available, fall back to smaller buffers.
+ * These are lowmem compound pages, physically contiguous and mapped as a
+ * whole, so page_address() plus an offset beyond PAGE_SIZE is valid. The
+ * transports' send_page() get the head page and such an offset: TCP's
+ * sendpage takes compound pages as they are, and kmap() of a lowmem page
+ * is just page_address(). */
+static struct page *alloc_send_buffer_page(unsigned int *order)
+{
+	struct page *page;
+
+	for (; *order > 0; (*order)--) {
+		page = alloc_pages(GFP_KERNEL | __GFP_COMP | __GFP_NOWARN | __GFP_NORETRY, *order);
+		if (page)
+			return page;
+	}
+	return alloc_page(GFP_KERNEL);
+}
+
+/* After falling back to a lower order, do not try the desired order again
+ * for a while, instead of failing to get it for every new buffer */
+static void set_send_buffer_page(struct drbd_send_buffer *sbuf, struct page *page,
+				 unsigned int order, unsigned int desired_order)
+{
+	sbuf->page = page;
+	sbuf->order = order;
+	if (order < desired_order)
+		sbuf->retry_order_jif = jiffies + HZ;
+	else
+		sbuf->retry_order_jif = jiffies;
+}
+
 static void new_or_recycle_send_buffer_page(struct drbd_send_buffer *sbuf)
 {
 	while (1) {
 		struct page *page;
+		unsigned int desired_order = send_buffer_order();
+		unsigned int order = desired_order;
 		int count = page_count(sbuf->page);
 
 		BUG_ON(count == 0);
-		if (count == 1)
+		if (time_before(jiffies, sbuf->retry_order_jif))
+			order = min(order, sbuf->order);
+		if (count == 1 && order == sbuf->order)
 			goto have_page;
 
-		page = alloc_page(GFP_KERNEL);
+		page = alloc_send_buffer_page(&order);
 		if (page) {
 			put_page(sbuf->page);
-			sbuf->page = page;
+			set_send_buffer_page(sbuf, page, order, desired_order);
 			goto have_page;
 		}
 
@@ -982,7 +1025,7 @@ static char *alloc_send_buffer(struct drbd_connection *connection, int size,
 	struct drbd_send_buffer *sbuf = &connection->send_buffer[drbd_stream];
 	char *page_start = page_address(sbuf->page);
 
-	if (sbuf->pos - page_start + size > PAGE_SIZE) {
+	if (sbuf->pos - page_start + size > PAGE_SIZE << sbuf->order) {
 		flush_send_buffer(connection, drbd_stream);
 		new_or_recycle_send_buffer_page(sbuf);
 	}
@@ -2836,6 +2879,7 @@ static void drbd_destroy_mempools(void)
 
 	/* D_ASSERT(device, atomic_read(&drbd_pp_vacant)==0); */
 
+	bioset_exit(&drbd_read_split_bio_set);
 	bioset_exit(&drbd_io_bio_set);
 	bioset_exit(&drbd_md_io_bio_set);
 	mempool_exit(&drbd_md_io_page_pool);
@@ -2890,6 +2934,10 @@ static int drbd_create_mempools(void)
 	if (ret)
 		goto Enomem;
 
+	ret = bioset_init(&drbd_read_split_bio_set, BIO_POOL_SIZE, 0, 0);
+	if (ret)
+		goto Enomem;
+
 	ret = bioset_init(&drbd_md_io_bio_set, DRBD_MIN_POOL_PAGES, 0,
 			  BIOSET_NEED_BVECS);
 	if (ret)
@@ -3033,6 +3081,8 @@ static struct retry_worker {
 	struct list_head writes;
 } retry;
 
+struct workqueue_struct *drbd_csum_wq;
+
 static void drbd_req_destroy_lock(struct kref *kref)
 {
 	struct drbd_request *req = container_of(kref, struct drbd_request, kref);
@@ -3130,6 +3180,9 @@ static void drbd_cleanup(void)
 	if (retry.wq)
 		destroy_workqueue(retry.wq);
 
+	if (drbd_csum_wq)
+		destroy_workqueue(drbd_csum_wq);
+
 	drbd_genl_unregister();
 	drbd_debugfs_cleanup();
 
@@ -3276,14 +3329,16 @@ static int drbd_alloc_send_buffers(struct drbd_connection *connection)
 	unsigned int i;
 
 	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
+		unsigned int desired_order = send_buffer_order();
+		unsigned int order = desired_order;
 		struct page *page;
 
-		page = alloc_page(GFP_KERNEL);
+		page = alloc_send_buffer_page(&order);
 		if (!page) {
 			drbd_put_send_buffers(connection);
 			return -ENOMEM;
 		}
-		connection->send_buffer[i].page = page;
+		set_send_buffer_page(&connection->send_buffer[i], page, order, desired_order);
 		connection->send_buffer[i].unsent =
 		connection->send_buffer[i].pos = page_address(page);
 	}
@@ -3523,7 +3578,7 @@ struct drbd_connection *drbd_create_connection(struct drbd_resource *resource,
 	kref_debug_init(&connection->kref_debug, &connection->kref, &kref_class_connection);
 
 	INIT_WORK(&connection->peer_ack_work, drbd_send_peer_ack_wf);
-	INIT_WORK(&connection->send_acks_work, drbd_send_acks_wf);
+	INIT_DELAYED_WORK(&connection->send_acks_work, drbd_send_acks_wf);
 
 	kref_get(&resource->kref);
 	kref_debug_get(&resource->kref_debug, 3);
@@ -4102,6 +4157,13 @@ static int __init drbd_init(void)
 	spin_lock_init(&retry.lock);
 	INIT_LIST_HEAD(&retry.writes);
 
+	/* unbound, so hashing of resync and verify data spreads over all CPUs */
+	drbd_csum_wq = alloc_workqueue("drbd_csum", WQ_UNBOUND | WQ_MEM_RECLAIM, 0);
+	if (!drbd_csum_wq) {
+		pr_err("unable to create csum workqueue\n");
+		goto fail;
+	}
+
 	if (drbd_debugfs_init())
 		pr_notice("failed to initialize debugfs -- will not be available\n");
 
@@ -1372,6 +1372,7 @@ char *ppsize(char *buf, unsigned long long size)
 void drbd_suspend_io(struct drbd_device *device, enum suspend_scope ss)
 {
 	atomic_inc(&device->suspend_cnt);
+	smp_mb(); /* pairs with inc_ap_bio_cond(), before looking at ap_bio_cnt */
 	if (drbd_suspended(device))
 		return;
 	wait_event(device->misc_wait,
@@ -2193,8 +2194,11 @@ static int disk_opts_check_al_size(struct drbd_device *device, struct disk_conf
 
 	drbd_suspend_io(device, READ_AND_WRITE);
 	/* If IO completion is currently blocked, we would likely wait
-	 * "forever" for the activity log to become unused. So we don't. */
-	if (atomic_read(&device->ap_bio_cnt[WRITE]) || atomic_read(&device->ap_bio_cnt[READ]))
+	 * "forever" for the activity log to become unused. So we don't.
+	 * If it is not, drbd_suspend_io() waited for ap_bio_cnt to drop to 0,
+	 * and anything counted now is a bio backing off in inc_ap_bio_cond(). */
+	if (drbd_suspended(device) &&
+	    (atomic_read(&device->ap_bio_cnt[WRITE]) || atomic_read(&device->ap_bio_cnt[READ])))
 		goto out;
 
 	wait_event(device->al_wait, drbd_al_try_lock(device));
@@ -3347,13 +3351,11 @@ int drbd_adm_net_opts(struct sk_buff *skb, struct genl_info *info)
 	connection->fencing_policy = new_net_conf->fencing_policy;
 
 	if (!rsr) {
-		crypto_free_ahash(connection->csums_tfm);
-		connection->csums_tfm = crypto.csums_tfm;
+		drbd_replace_csum_tfm(connection, &connection->csums_tfm, crypto.csums_tfm);
 		crypto.csums_tfm = NULL;
 	}
 	if (!ovr) {
-		crypto_free_ahash(connection->verify_tfm);
-		connection->verify_tfm = crypto.verify_tfm;
+		drbd_replace_csum_tfm(connection, &connection->verify_tfm, crypto.verify_tfm);
 		crypto.verify_tfm = NULL;
 	}
 
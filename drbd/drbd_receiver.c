@@ -435,6 +435,8 @@ void __drbd_free_peer_req(struct drbd_peer_request *peer_req, int is_net)
 	might_sleep();
 	if (peer_req->flags & EE_HAS_DIGEST)
 		kfree(peer_req->digest);
+	if (peer_req->flags & EE_HAS_CSUM)
+		kfree(peer_req->csum);
 	D_ASSERT(peer_device, atomic_read(&peer_req->pending_bios) == 0);
 	D_ASSERT(peer_device, drbd_interval_empty(&peer_req->i));
 	drbd_free_page_chain(&peer_device->connection->transport, &peer_req->page_chain, is_net);
@@ -1702,7 +1704,7 @@ static void drbd_remove_peer_req_interval(struct drbd_device *device,
 {
 	struct drbd_interval *i = &peer_req->i;
 
-	drbd_remove_interval(&device->write_requests, i);
+	drbd_remove_write_interval(device, i);
 	drbd_clear_interval(i);
 	peer_req->flags &= ~EE_IN_INTERVAL_TREE;
 
@@ -1771,6 +1773,8 @@ int w_e_reissue(struct drbd_work *w, int cancel) __releases(local)
 
 static void conn_wait_done_ee_empty_or_disconnect(struct drbd_connection *connection)
 {
+	/* do not let delayed acks hold us up */
+	drbd_queue_send_acks(connection, true);
 	wait_event(connection->ee_wait,
 		atomic_read(&connection->done_ee_cnt) == 0
 		|| connection->cstate[NOW] < C_CONNECTED);
@@ -1797,6 +1801,8 @@ static int receive_Barrier(struct drbd_connection *connection, struct packet_inf
 
 	tr_ops->hint(&connection->transport, DATA_STREAM, QUICKACK);
 	drbd_unplug_all_devices(connection);
+	/* the peer waits for the acks of this epoch, do not delay them */
+	drbd_queue_send_acks(connection, true);
 
 	/* FIXME these are unacked on connection,
 	 * not a specific (peer)device.
@@ -2260,7 +2266,7 @@ static int receive_RSDataReply(struct drbd_connection *connection, struct packet
 		drbd_send_ack_dp(peer_device, P_NEG_ACK, &d);
 	}
 
-	atomic_add(d.bi_size >> 9, &peer_device->rs_sect_in);
+	drbd_rs_sect_in(peer_device, d.bi_size >> 9);
 
 	return err;
 }
@@ -2565,16 +2571,23 @@ static int handle_write_conflicts(struct drbd_peer_request *peer_req)
 	sector_t sector = peer_req->i.sector;
 	const unsigned int size = peer_req->i.size;
 	struct drbd_interval *i;
+	bool may_conflict;
 	bool equal;
 	int err;
 
+	may_conflict = drbd_interval_filter_may_overlap(&device->write_requests_filter,
+							sector, size);
+
 	/*
 	 * Inserting the peer request into the write_requests tree will prevent
 	 * new conflicting local requests from being added.
 	 */
-	drbd_insert_interval(&device->write_requests, &peer_req->i);
+	drbd_insert_write_interval(device, &peer_req->i);
 	peer_req->flags |= EE_IN_INTERVAL_TREE;
 
+	if (!may_conflict)
+		return 0;
+
     repeat:
 	drbd_for_each_overlap(i, &device->write_requests, sector, size) {
 		if (i == &peer_req->i)
@@ -2617,7 +2630,7 @@ static int handle_write_conflicts(struct drbd_peer_request *peer_req)
 						   e_send_retry_write;
 			atomic_inc(&connection->done_ee_cnt);
 			list_add_tail(&peer_req->w.list, &connection->done_ee);
-			queue_work(connection->ack_sender, &connection->send_acks_work);
+			drbd_queue_send_acks(connection, false);
 
 			err = -ENOENT;
 			goto out;
@@ -3269,12 +3282,14 @@ static int receive_DataRequest(struct drbd_connection *connection, struct packet
 		if (pi->cmd == P_CSUM_RS_REQUEST) {
 			D_ASSERT(device, connection->agreed_pro_version >= 89);
 			peer_req->w.cb = w_e_end_csum_rs_req;
+			peer_req->flags |= EE_CSUM_RS;
 			/* remember to report stats in drbd_resync_finished */
 			peer_device->use_csums = true;
 		} else if (pi->cmd == P_OV_REPLY) {
 			/* track progress, we may need to throttle */
 			atomic_add(size >> 9, &peer_device->rs_sect_in);
 			peer_req->w.cb = w_e_end_ov_reply;
+			peer_req->flags |= EE_CSUM_OV;
 			dec_rs_pending(peer_device);
 			/* drbd_rs_begin_io done when we sent this request,
 			 * but accounting still needs to be done. */
@@ -3301,6 +3316,7 @@ static int receive_DataRequest(struct drbd_connection *connection, struct packet
 					(unsigned long long)sector);
 		}
 		peer_req->w.cb = w_e_end_ov_req;
+		peer_req->flags |= EE_CSUM_OV;
 		fault_type = DRBD_FAULT_RS_RD;
 		break;
 
@@ -4606,15 +4622,13 @@ static int receive_SyncParam(struct drbd_connection *connection, struct packet_i
 			if (verify_tfm) {
 				strcpy(new_net_conf->verify_alg, p->verify_alg);
 				new_net_conf->verify_alg_len = strlen(p->verify_alg) + 1;
-				crypto_free_ahash(connection->verify_tfm);
-				connection->verify_tfm = verify_tfm;
+				drbd_replace_csum_tfm(connection, &connection->verify_tfm, verify_tfm);
 				drbd_info(device, "using verify-alg: \"%s\"\n", p->verify_alg);
 			}
 			if (csums_tfm) {
 				strcpy(new_net_conf->csums_alg, p->csums_alg);
 				new_net_conf->csums_alg_len = strlen(p->csums_alg) + 1;
-				crypto_free_ahash(connection->csums_tfm);
-				connection->csums_tfm = csums_tfm;
+				drbd_replace_csum_tfm(connection, &connection->csums_tfm, csums_tfm);
 				drbd_info(device, "using csums-alg: \"%s\"\n", p->csums_alg);
 			}
 			rcu_assign_pointer(connection->transport.net_conf, new_net_conf);
@@ -7507,7 +7521,7 @@ static int receive_rs_deallocated(struct drbd_connection *connection, struct pac
 		drbd_send_ack_ex(peer_device, P_NEG_ACK, sector, size, ID_SYNCER);
 	}
 
-	atomic_add(size >> 9, &peer_device->rs_sect_in);
+	drbd_rs_sect_in(peer_device, size >> 9);
 
 	return err;
 }
@@ -7726,6 +7740,7 @@ void conn_disconnect(struct drbd_connection *connection)
 	/* ack_receiver does not clean up anything. it must not interfere, either */
 	drbd_thread_stop(&connection->ack_receiver);
 	if (connection->ack_sender) {
+		flush_delayed_work(&connection->send_acks_work);
 		destroy_workqueue(connection->ack_sender);
 		connection->ack_sender = NULL;
 	}
@@ -8368,7 +8383,7 @@ static int got_IsInSync(struct drbd_connection *connection, struct packet_info *
 		put_ldev(device);
 	}
 	dec_rs_pending(peer_device);
-	atomic_add(blksize >> 9, &peer_device->rs_sect_in);
+	drbd_rs_sect_in(peer_device, blksize >> 9);
 
 	return 0;
 }
@@ -8541,7 +8556,7 @@ static int got_NegRSDReply(struct drbd_connection *connection, struct packet_inf
 				mutex_unlock(&device->bm_resync_fo_mutex);
 			}
 
-			atomic_add(size >> 9, &peer_device->rs_sect_in);
+			drbd_rs_sect_in(peer_device, size >> 9);
 			mod_timer(&peer_device->resync_timer, jiffies + SLEEP_TIME);
 			break;
 		default:
@@ -9019,10 +9034,43 @@ disconnect:
 	return 0;
 }
 
+/* With DRBD_ACK_DELAY_MS set, acks of completed peer requests are collected
+ * until DRBD_ACK_BATCH of them are pending or the delay expires. They then go
+ * out together, corked, from drbd_send_acks_wf().
+ * The delay is limited to DRBD_ACK_DELAY_MAX_MS and to a quarter of the
+ * ping timeout, so that the peer never runs into a timeout because of it. */
+void drbd_queue_send_acks(struct drbd_connection *connection, bool now)
+{
+	unsigned int delay = min(DRBD_ACK_DELAY_MS, DRBD_ACK_DELAY_MAX_MS);
+	struct net_conf *nc;
+
+	/* Without a delay no timer is ever armed, and a plain queue_work()
+	 * avoids the cost of mod_delayed_work() for every completion. */
+	if (!delay) {
+		queue_work(connection->ack_sender, &connection->send_acks_work.work);
+		return;
+	}
+
+	/* pull an armed timer forward */
+	if (now || atomic_read(&connection->done_ee_cnt) >= DRBD_ACK_BATCH) {
+		mod_delayed_work(connection->ack_sender, &connection->send_acks_work, 0);
+		return;
+	}
+
+	rcu_read_lock();
+	nc = rcu_dereference(connection->transport.net_conf);
+	if (nc)
+		delay = min(delay, nc->ping_timeo * 100 / 4);
+	rcu_read_unlock();
+
+	queue_delayed_work(connection->ack_sender, &connection->send_acks_work,
+			   msecs_to_jiffies(delay));
+}
+
 void drbd_send_acks_wf(struct work_struct *ws)
 {
 	struct drbd_connection *connection =
-		container_of(ws, struct drbd_connection, send_acks_work);
+		container_of(ws, struct drbd_connection, send_acks_work.work);
 	struct drbd_transport *transport = &connection->transport;
 	struct net_conf *nc;
 	int tcp_cork, err;
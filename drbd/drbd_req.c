@@ -162,13 +162,15 @@ static bool peer_ack_window_full(struct drbd_request *req)
 	return dagtag_newer_eq(req->dagtag_sector, last_dagtag);
 }
 
-static void drbd_remove_request_interval(struct rb_root *root,
-					 struct drbd_request *req)
+static void drbd_remove_request_interval(struct drbd_request *req)
 {
 	struct drbd_device *device = req->device;
 	struct drbd_interval *i = &req->i;
 
-	drbd_remove_interval(root, i);
+	if (req->local_rq_state & RQ_WRITE)
+		drbd_remove_write_interval(device, i);
+	else
+		drbd_remove_interval(&device->read_requests, i);
 
 	/* Wake up any processes waiting for this request to complete.  */
 	if (i->waiting)
@@ -239,13 +241,7 @@ void drbd_req_destroy(struct kref *kref)
 	/* finally remove the request from the conflict detection
 	 * respective block_id verification interval tree. */
 	if (!drbd_interval_empty(&req->i)) {
-		struct rb_root *root;
-
-		if (s & RQ_WRITE)
-			root = &device->write_requests;
-		else
-			root = &device->read_requests;
-		drbd_remove_request_interval(root, req);
+		drbd_remove_request_interval(req);
 	} else if (s & (RQ_NET_MASK & ~RQ_NET_DONE) && req->i.size != 0)
 		drbd_err(device, "drbd_req_destroy: Logic BUG: interval empty, but: rq_state=0x%x, sect=%llu, size=%u\n",
 			s, (unsigned long long)req->i.sector, req->i.size);
@@ -1252,6 +1248,10 @@ static void complete_conflicting_writes(struct drbd_request *req)
 	sector_t sector = req->i.sector;
 	int size = req->i.size;
 
+	/* The common case: nothing in flight anywhere near us. */
+	if (!drbd_interval_filter_may_overlap(&device->write_requests_filter, sector, size))
+		return;
+
 	for (;;) {
 		drbd_for_each_overlap(i, &device->write_requests, sector, size) {
 			/* Ignore, if already completed to upper layers. */
@@ -1480,7 +1480,7 @@ static int drbd_process_write_request(struct drbd_request *req)
 			if (!in_tree) {
 				/* Corresponding drbd_remove_request_interval is in
 				 * drbd_req_complete() */
-				drbd_insert_interval(&device->write_requests, &req->i);
+				drbd_insert_write_interval(device, &req->i);
 				in_tree = true;
 			}
 			_req_mod(req, QUEUE_FOR_NET_WRITE, peer_device);
@@ -1867,8 +1867,8 @@ out:
 
 static bool inc_ap_bio_cond(struct drbd_device *device, int rw)
 {
-	bool rv = false;
 	unsigned int nr_requests;
+	int ap_bio;
 
 	if (test_bit(NEW_CUR_UUID, &device->flags)) {
 		if (!test_and_set_bit(WRITING_NEW_CUR_UUID, &device->flags))
@@ -1877,14 +1877,33 @@ static bool inc_ap_bio_cond(struct drbd_device *device, int rw)
 		return false;
 	}
 
-	spin_lock_irq(&device->resource->req_lock);
+	/* Do not serialize every submitter on req_lock just for this.
+	 * Take the slot first, then check whether we were allowed to,
+	 * as described in drbd_queue_bitmap_io().  If not, give it back;
+	 * dec_ap_bio() kicks pending bitmap work if we were the last one.
+	 *
+	 * atomic_inc_return() is a full barrier.  It pairs with a full barrier
+	 * of each writer that sets one of the conditions checked in
+	 * may_inc_ap_bio() and then looks at ap_bio_cnt:
+	 *  - drbd_suspend_io() for suspend_cnt,
+	 *  - ___end_state_change() for cached_susp and cached_state_unstable,
+	 *  - drbd_queue_bitmap_io() for pending_bitmap_work.
+	 * Either the writer sees our slot and waits for it, or we see the
+	 * new condition and back off.
+	 *
+	 * Check before taking the slot as well, so waiters do not keep
+	 * waking each other up with their give-backs while IO is frozen. */
 	nr_requests = device->resource->res_opts.nr_requests;
-	rv = may_inc_ap_bio(device) && atomic_read(&device->ap_bio_cnt[rw]) < nr_requests;
-	if (rv)
-		atomic_inc(&device->ap_bio_cnt[rw]);
-	spin_unlock_irq(&device->resource->req_lock);
+	if (!may_inc_ap_bio(device) ||
+	    atomic_read(&device->ap_bio_cnt[rw]) >= nr_requests)
+		return false;
 
-	return rv;
+	ap_bio = atomic_inc_return(&device->ap_bio_cnt[rw]);
+	if (ap_bio <= nr_requests && may_inc_ap_bio(device))
+		return true;
+
+	dec_ap_bio(device, rw);
+	return false;
 }
 
 static void inc_ap_bio(struct drbd_device *device, int rw)
@@ -1894,8 +1913,13 @@ static void inc_ap_bio(struct drbd_device *device, int rw)
 	 *    until the bitmap is no longer on the fly during connection
 	 *    handshake as long as we would exceed the max_buffer limit.
 	 *
-	 * to avoid races with the reconnect code,
-	 * we need to atomic_inc within the spinlock. */
+	 * inc_ap_bio_cond() does not take req_lock.  It takes a slot with
+	 * atomic_inc_return() and then re-checks may_inc_ap_bio().  That
+	 * pairs with the smp_mb() in drbd_suspend_io() and
+	 * ___end_state_change(), and with the atomic_dec_return() of the
+	 * dec_ap_bio() that ends drbd_queue_bitmap_io().  All of them set
+	 * their condition before they look at ap_bio_cnt.  Whoever loses
+	 * gives the slot back and waits here. */
 
 	wait_event(device->misc_wait, inc_ap_bio_cond(device, rw));
 }
@@ -2259,6 +2283,51 @@ void do_submit(struct work_struct *ws)
 #endif
 #endif
 
+/* Large READs we can not serve locally (diskless, or local disk not
+ * UpToDate) would all go to one single peer. If more than one peer is
+ * UpToDate, split them on read_stripe_kb boundaries instead. Each piece
+ * becomes a drbd_request of its own, and find_peer_device_for_read() rotates
+ * through device->read_nodes, so the pieces are requested from different
+ * peers in parallel. bio_chain() completes the master bio once all pieces
+ * are done.
+ *
+ * Submits all but the last piece, and returns that one to the caller.
+ */
+#ifndef CONFIG_DRBD_TIMING_STATS
+#define drbd_stripe_remote_read(d,b,k,j) drbd_stripe_remote_read(d,b,j)
+#endif
+static struct bio *
+drbd_stripe_remote_read(struct drbd_device *device, struct bio *bio,
+		ktime_t start_kt,
+		unsigned long start_jif)
+{
+	unsigned int stripe_kb = DRBD_READ_STRIPE_KB;
+	unsigned int stripe_sectors, sectors;
+	struct bio *split;
+
+	if (!stripe_kb || bio_op(bio) != REQ_OP_READ)
+		return bio;
+
+	stripe_sectors = rounddown_pow_of_two(stripe_kb) << 1;
+	if ((DRBD_BIO_BI_SIZE(bio) >> 9) <= stripe_sectors)
+		return bio;
+
+	if (device->disk_state[NOW] == D_UP_TO_DATE ||
+	    hweight64(calc_nodes_to_read_from(device)) < 2)
+		return bio;
+
+	for (;;) {
+		sectors = stripe_sectors - (DRBD_BIO_BI_SECTOR(bio) & (stripe_sectors - 1));
+		if (sectors >= (DRBD_BIO_BI_SIZE(bio) >> 9))
+			break;
+
+		split = bio_split(bio, sectors, GFP_NOIO, &drbd_read_split_bio_set);
+		bio_chain(split, bio);
+		__drbd_make_request(device, split, start_kt, start_jif);
+	}
+	return bio;
+}
+
 MAKE_REQUEST_TYPE drbd_make_request(struct request_queue *q, struct bio *bio)
 {
 	struct drbd_device *device = (struct drbd_device *) q->queuedata;
@@ -2294,6 +2363,7 @@ MAKE_REQUEST_TYPE drbd_make_request(struct request_queue *q, struct bio *bio)
 	ktime_get_accounting(start_kt);
 	start_jif = jiffies;
 
+	bio = drbd_stripe_remote_read(device, bio, start_kt, start_jif);
 	__drbd_make_request(device, bio, start_kt, start_jif);
 
 #ifdef COMPAT_NEED_MAKE_REQUEST_RECURSION
@@ -46,6 +46,7 @@ static int make_resync_request(struct drbd_peer_device *, int);
 static bool should_send_barrier(struct drbd_connection *, unsigned int epoch);
 static void maybe_send_barrier(struct drbd_connection *, unsigned int);
 static unsigned long get_work_bits(const unsigned long mask, unsigned long *flags);
+static int w_e_send_csum(struct drbd_work *, int);
 
 /* endio handlers:
  *   drbd_md_endio (defined here)
@@ -95,6 +96,101 @@ void drbd_md_endio BIO_ENDIO_ARGS(struct bio *bio)
 	wake_up(&device->misc_wait);
 }
 
+/* Caller holds rcu_read_lock(), see drbd_replace_csum_tfm().
+ * The generation is read first: a digest may be tagged with an older
+ * generation than the tfm that computed it, but never with a newer one. */
+static struct crypto_ahash *peer_req_csum_tfm(struct drbd_peer_request *peer_req, unsigned int *gen)
+{
+	struct drbd_connection *connection = peer_req->peer_device->connection;
+
+	*gen = READ_ONCE(connection->csum_tfm_gen);
+	smp_rmb(); /* pairs with smp_wmb() in drbd_replace_csum_tfm() */
+	if (peer_req->flags & EE_CSUM_RS)
+		return READ_ONCE(connection->csums_tfm);
+	if (peer_req->flags & EE_CSUM_OV)
+		return READ_ONCE(connection->verify_tfm);
+	return NULL;
+}
+
+/* Replace csums_tfm or verify_tfm; serialized by resource->conf_update.
+ * drbd_queue_csum_work() picks the tfm under rcu_read_lock(), and the
+ * work it queues uses it later.  So wait for both before freeing it.
+ * The new generation makes drbd_csum_peer_req() ignore digests computed
+ * with the old tfm, even if the new one is allocated at the same address. */
+void drbd_replace_csum_tfm(struct drbd_connection *connection,
+			   struct crypto_ahash **tfm, struct crypto_ahash *new_tfm)
+{
+	struct crypto_ahash *old_tfm = *tfm;
+
+	WRITE_ONCE(*tfm, new_tfm);
+	smp_wmb(); /* pairs with smp_rmb() in peer_req_csum_tfm() */
+	WRITE_ONCE(connection->csum_tfm_gen, connection->csum_tfm_gen + 1);
+
+	if (old_tfm) {
+		synchronize_rcu();
+		flush_workqueue(drbd_csum_wq);
+		crypto_free_ahash(old_tfm);
+	}
+}
+
+static void drbd_read_sec_to_sender(struct drbd_peer_request *peer_req)
+{
+	struct drbd_device *device = peer_req->peer_device->device;
+	struct drbd_connection *connection = peer_req->peer_device->connection;
+	unsigned long flags;
+
+	spin_lock_irqsave(&device->resource->req_lock, flags);
+	list_del(&peer_req->w.list);
+	if (list_empty(&connection->read_ee))
+		wake_up(&connection->ee_wait);
+	spin_unlock_irqrestore(&device->resource->req_lock, flags);
+
+	drbd_queue_work(&connection->sender_work, &peer_req->w);
+}
+
+/* Checksum based resync and online verify hash every block they read.
+ * Do that here, on any CPU, instead of serialized in the sender.
+ * The peer request stays on read_ee until it is handed to the sender,
+ * so that drain_resync_activity() still waits for it. */
+static void drbd_csum_work_fn(struct work_struct *ws)
+{
+	struct drbd_peer_req_csum *csum = container_of(ws, struct drbd_peer_req_csum, work);
+	struct drbd_peer_request *peer_req = csum->peer_req;
+
+	drbd_csum_pages(csum->tfm, peer_req->page_chain.head, csum->digest);
+	drbd_read_sec_to_sender(peer_req);
+}
+
+/* Without memory for the digest, the sender hashes the data itself */
+static bool drbd_queue_csum_work(struct drbd_peer_request *peer_req)
+{
+	struct drbd_peer_req_csum *csum = NULL;
+	struct crypto_ahash *tfm;
+	unsigned int gen, size = 0;
+
+	rcu_read_lock();
+	tfm = peer_req_csum_tfm(peer_req, &gen);
+	if (tfm) {
+		size = crypto_ahash_digestsize(tfm);
+		csum = kmalloc(sizeof(*csum) + size, GFP_ATOMIC);
+	}
+	if (csum) {
+		csum->peer_req = peer_req;
+		csum->tfm = tfm;
+		csum->tfm_gen = gen;
+		csum->size = size;
+		/* all bios have completed, no need for atomic bit ops */
+		peer_req->csum = csum;
+		peer_req->flags |= EE_HAS_CSUM;
+
+		INIT_WORK(&csum->work, drbd_csum_work_fn);
+		queue_work(drbd_csum_wq, &csum->work);
+	}
+	rcu_read_unlock();
+
+	return csum != NULL;
+}
+
 /* reads on behalf of the partner,
  * "submitted" by the receiver
  */
@@ -103,18 +199,15 @@ static void drbd_endio_read_sec_final(struct drbd_peer_request *peer_req) __rele
 	unsigned long flags = 0;
 	struct drbd_peer_device *peer_device = peer_req->peer_device;
 	struct drbd_device *device = peer_device->device;
-	struct drbd_connection *connection = peer_device->connection;
 
 	spin_lock_irqsave(&device->resource->req_lock, flags);
 	device->read_cnt += peer_req->i.size >> 9;
-	list_del(&peer_req->w.list);
-	if (list_empty(&connection->read_ee))
-		wake_up(&connection->ee_wait);
 	if (test_bit(__EE_WAS_ERROR, &peer_req->flags))
 		__drbd_chk_io_error(device, DRBD_READ_ERROR);
 	spin_unlock_irqrestore(&device->resource->req_lock, flags);
 
-	drbd_queue_work(&connection->sender_work, &peer_req->w);
+	if ((peer_req->flags & EE_WAS_ERROR) || !drbd_queue_csum_work(peer_req))
+		drbd_read_sec_to_sender(peer_req);
 	put_ldev(device);
 }
 
@@ -192,7 +285,7 @@ void drbd_endio_write_sec_final(struct drbd_peer_request *peer_req) __releases(l
 		__drbd_chk_io_error(device, DRBD_WRITE_ERROR);
 
 	if (connection->cstate[NOW] == C_CONNECTED)
-		queue_work(connection->ack_sender, &connection->send_acks_work);
+		drbd_queue_send_acks(connection, false);
 	spin_unlock_irqrestore(&device->resource->req_lock, flags);
 
 	if (block_id == ID_SYNCER)
@@ -350,6 +443,19 @@ void drbd_csum_pages(struct crypto_ahash *tfm, struct page *page, void *digest)
 	ahash_request_zero(req);
 }
 
+/* Use the digest computed on drbd_csum_wq, unless the tfm
+ * was replaced in the meantime */
+static void drbd_csum_peer_req(struct crypto_ahash *tfm, struct drbd_peer_request *peer_req, void *digest)
+{
+	struct drbd_connection *connection = peer_req->peer_device->connection;
+	struct drbd_peer_req_csum *csum = peer_req->flags & EE_HAS_CSUM ? peer_req->csum : NULL;
+
+	if (csum && csum->tfm == tfm && csum->tfm_gen == READ_ONCE(connection->csum_tfm_gen))
+		memcpy(digest, csum->digest, csum->size);
+	else
+		drbd_csum_pages(tfm, peer_req->page_chain.head, digest);
+}
+
 void drbd_csum_bio(struct crypto_ahash *tfm, struct bio *bio, void *digest)
 {
 	DRBD_BIO_VEC_TYPE bvec;
@@ -395,7 +501,7 @@ static int w_e_send_csum(struct drbd_work *w, int cancel)
 	digest_size = crypto_ahash_digestsize(peer_device->connection->csums_tfm);
 	digest = drbd_prepare_drequest_csum(peer_req, digest_size);
 	if (digest) {
-		drbd_csum_pages(peer_device->connection->csums_tfm, peer_req->page_chain.head, digest);
+		drbd_csum_peer_req(peer_device->connection->csums_tfm, peer_req, digest);
 		/* Free peer_req and pages before send.
 		 * In case we block on congestion, we could otherwise run into
 		 * some distributed deadlock, if the other side blocks on
@@ -442,6 +548,7 @@ static int read_for_csum(struct drbd_peer_device *peer_device, sector_t sector,
 	peer_req->block_id = ID_SYNCER; /* unused */
 
 	peer_req->w.cb = w_e_send_csum;
+	peer_req->flags |= EE_CSUM_RS;
 	spin_lock_irq(&device->resource->req_lock);
 	list_add_tail(&peer_req->w.list, &peer_device->connection->read_ee);
 	spin_unlock_irq(&device->resource->req_lock);
@@ -606,6 +713,75 @@ static int drbd_rs_controller(struct drbd_peer_device *peer_device, unsigned int
 	return req_sect;
 }
 
+/* Delay based alternative to drbd_rs_controller(), see DRBD_RS_DELAY_BASED.
+ * By Little's law, sectors in flight divided by sectors coming back per time
+ * is the latency of a resync request. The lowest latency seen is the latency
+ * without any queuing, everything above it is queuing delay in the network,
+ * on the peer's disk and in our own receive path. Grow the in-flight window
+ * while that delay stays below c-delay-target, shrink it in proportion to the
+ * excess otherwise. Application IO still throttles the resync through
+ * c-min-rate, in drbd_rs_should_slow_down().
+ *
+ * Replies clock this controller (drbd_rs_sect_in()), the resync timer is only
+ * the fallback. So it works with the actual time since it ran last, and tops
+ * up the window instead of handing out a budget per SLEEP_TIME. */
+static int drbd_rs_delay_controller(struct drbd_peer_device *peer_device, unsigned int sect_in)
+{
+	struct peer_device_conf *pdc = rcu_dereference(peer_device->conf);
+	unsigned int in_flight = peer_device->rs_in_flight + sect_in;
+	unsigned int window = peer_device->rs_ctl_window;
+	unsigned int target_us = pdc->c_delay_target * 100000; /* unit 0.1 sec */
+	ktime_t now = ktime_get();
+	s64 elapsed_us = ktime_us_delta(now, peer_device->rs_ctl_last);
+	int req_sect, max_sect;
+
+	/* c-max-rate, per SLEEP_TIME */
+	max_sect = (pdc->c_max_rate * 2 * SLEEP_TIME) / HZ;
+
+	if (!window) { /* At start of resync */
+		window = (pdc->resync_rate * 2 * SLEEP_TIME) / HZ;
+		peer_device->c_sync_rate = pdc->resync_rate;
+		peer_device->rs_ctl_last = now;
+	} else if (sect_in && elapsed_us > 0) {
+		u64 lat = div_u64((u64)in_flight * elapsed_us, sect_in);
+		unsigned int lat_us = max_t(u64, min_t(u64, lat, UINT_MAX), 1);
+		unsigned int base = peer_device->rs_ctl_lat_base;
+
+		/* Let the base follow slowly, in case the path changed */
+		if (!base || lat_us < base)
+			base = lat_us;
+		else
+			base += (lat_us - base) / 64;
+
+		if (lat_us - base <= target_us) {
+			/* Only grow if we actually used the window */
+			if (in_flight >= window / 2)
+				window += max_t(unsigned int, window / 8, BM_SECT_PER_BIT);
+		} else {
+			window = div_u64((u64)window * (base + target_us), lat_us);
+		}
+
+		/* window / latency is the rate, respect c-max-rate */
+		window = min_t(u64, window, div_u64((u64)pdc->c_max_rate * 2 * lat_us, USEC_PER_SEC));
+		/* rate in KiB/s, 2 sectors per KiB */
+		peer_device->c_sync_rate = div_u64((u64)window * USEC_PER_SEC / 2, lat_us);
+
+		peer_device->rs_ctl_lat = lat_us;
+		peer_device->rs_ctl_lat_base = base;
+		peer_device->rs_ctl_last = now;
+	}
+	window = max_t(unsigned int, window, BM_SECT_PER_BIT);
+	peer_device->rs_ctl_window = window;
+
+	req_sect = (int)window - peer_device->rs_in_flight;
+	if (req_sect < 0)
+		req_sect = 0;
+	if (req_sect > max_sect)
+		req_sect = max_sect;
+
+	return req_sect;
+}
+
 static int drbd_rs_number_requests(struct drbd_peer_device *peer_device)
 {
 	struct net_conf *nc;
@@ -619,9 +795,16 @@ static int drbd_rs_number_requests(struct drbd_peer_device *peer_device)
 	nc = rcu_dereference(peer_device->connection->transport.net_conf);
 	mxb = nc ? nc->max_buffers : 0;
 	if (rcu_dereference(peer_device->rs_plan_s)->size) {
-		number = drbd_rs_controller(peer_device, sect_in) >> (BM_BLOCK_SHIFT - 9);
-		peer_device->c_sync_rate = number * HZ * (BM_BLOCK_SIZE / 1024) / SLEEP_TIME;
+		if (DRBD_RS_DELAY_BASED) {
+			/* sets c_sync_rate itself */
+			number = drbd_rs_delay_controller(peer_device, sect_in) >> (BM_BLOCK_SHIFT - 9);
+		} else {
+			peer_device->rs_ctl_window = 0;
+			number = drbd_rs_controller(peer_device, sect_in) >> (BM_BLOCK_SHIFT - 9);
+			peer_device->c_sync_rate = number * HZ * (BM_BLOCK_SIZE / 1024) / SLEEP_TIME;
+		}
 	} else {
+		peer_device->rs_ctl_window = 0;
 		peer_device->c_sync_rate = rcu_dereference(peer_device->conf)->resync_rate;
 		number = SLEEP_TIME * peer_device->c_sync_rate  / ((BM_BLOCK_SIZE / 1024) * HZ);
 	}
@@ -649,9 +832,10 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 	unsigned long bit;
 	sector_t sector;
 	const sector_t capacity = drbd_get_capacity(device->this_bdev);
+	unsigned long max_bits, run_bits;
 	int max_bio_size;
 	int number, rollback_i, size;
-	int align, requeue = 0;
+	int requeue = 0;
 	int i = 0;
 	int discard_granularity = 0;
 
@@ -705,7 +889,6 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 			goto requeue;
 
 next_sector:
-		size = BM_BLOCK_SIZE;
 		bit  = drbd_bm_find_next(peer_device, device->bm_resync_fo);
 
 		if (bit == DRBD_END_OF_BITMAP) {
@@ -722,52 +905,37 @@ next_sector:
 		}
 		device->bm_resync_fo = bit + 1;
 
-		if (unlikely(drbd_bm_test_bit(peer_device, bit) == 0)) {
-			drbd_rs_complete_io(peer_device, sector);
-			goto next_sector;
-		}
-
 #if DRBD_MAX_BIO_SIZE > BM_BLOCK_SIZE
-		/* try to find some adjacent bits.
+		/* grow the request to the run of dirty bits starting here.
 		 * we stop if we have already the maximum req size.
 		 *
 		 * Additionally always align bigger requests, in order to
-		 * be prepared for all stripe sizes of software RAIDs.
+		 * be prepared for all stripe sizes of software RAIDs:
+		 * a request may not be larger than the alignment of its start.
+		 *
+		 * Do not cross extent boundaries, we hold only this one.
 		 */
-		align = 1;
-		rollback_i = i;
-		while (i < number) {
-			if (size + BM_BLOCK_SIZE > max_bio_size)
-				break;
-
-			/* Be always aligned */
-			if (sector & ((1<<(align+3))-1))
-				break;
-
-			if (discard_granularity && size == discard_granularity)
-				break;
-
-			/* do not cross extent boundaries */
-			if (((bit+1) & BM_BLOCKS_PER_BM_EXT_MASK) == 0)
-				break;
-			/* now, is it actually dirty, after all?
-			 * caution, drbd_bm_test_bit is tri-state for some
-			 * obscure reason; ( b == 0 ) would get the out-of-band
-			 * only accidentally right because of the "oddly sized"
-			 * adjustment below */
-			if (drbd_bm_test_bit(peer_device, bit + 1) != 1)
-				break;
-			bit++;
-			size += BM_BLOCK_SIZE;
-			if ((BM_BLOCK_SIZE << align) <= size)
-				align++;
-			i++;
-		}
-		/* if we merged some,
-		 * reset the offset to start the next drbd_bm_find_next from */
-		if (size > BM_BLOCK_SIZE)
-			device->bm_resync_fo = bit + 1;
+		max_bits = min_t(unsigned long, max_bio_size >> BM_BLOCK_SHIFT,
+				 BM_BITS_PER_EXT - (bit & BM_BLOCKS_PER_BM_EXT_MASK));
+		max_bits = min_t(unsigned long, max_bits, number - i);
+		if (bit)
+			max_bits = min(max_bits, bit & -bit);
+		if (discard_granularity)
+			max_bits = min_t(unsigned long, max_bits,
+					 max(discard_granularity >> BM_BLOCK_SHIFT, 1));
+#else
+		max_bits = 1;
 #endif
+		/* now, is it actually dirty, after all? */
+		if (unlikely(drbd_bm_find_next_run(peer_device, bit, max_bits, &run_bits) != bit)) {
+			drbd_rs_complete_io(peer_device, sector);
+			goto next_sector;
+		}
+
+		rollback_i = i;
+		size = run_bits << BM_BLOCK_SHIFT;
+		i += run_bits - 1;
+		device->bm_resync_fo = bit + run_bits;
 
 		/* adjust very last sectors, in case we are oddly sized */
 		if (sector + (size>>9) > capacity)
@@ -1405,7 +1573,7 @@ int w_e_end_csum_rs_req(struct drbd_work *w, int cancel)
 			D_ASSERT(device, digest_size == di->digest_size);
 			digest = kmalloc(digest_size, GFP_NOIO);
 			if (digest) {
-				drbd_csum_pages(peer_device->connection->csums_tfm, peer_req->page_chain.head, digest);
+				drbd_csum_peer_req(peer_device->connection->csums_tfm, peer_req, digest);
 				eq = !memcmp(digest, di->digest, digest_size);
 				kfree(digest);
 			}
@@ -1457,7 +1625,7 @@ int w_e_end_ov_req(struct drbd_work *w, int cancel)
 	}
 
 	if (!(peer_req->flags & EE_WAS_ERROR))
-		drbd_csum_pages(peer_device->connection->verify_tfm, peer_req->page_chain.head, digest);
+		drbd_csum_peer_req(peer_device->connection->verify_tfm, peer_req, digest);
 	else
 		memset(digest, 0, digest_size);
 
@@ -1542,7 +1710,7 @@ int w_e_end_ov_reply(struct drbd_work *w, int cancel)
 		digest_size = crypto_ahash_digestsize(peer_device->connection->verify_tfm);
 		digest = kmalloc(digest_size, GFP_NOIO);
 		if (digest) {
-			drbd_csum_pages(peer_device->connection->verify_tfm, peer_req->page_chain.head, digest);
+			drbd_csum_peer_req(peer_device->connection->verify_tfm, peer_req, digest);
 
 			D_ASSERT(device, digest_size == di->digest_size);
 			eq = !memcmp(digest, di->digest, digest_size);
@@ -1810,6 +1978,9 @@ void drbd_rs_controller_reset(struct drbd_peer_device *peer_device)
 	atomic_set(&peer_device->rs_sect_in, 0);
 	atomic_set(&peer_device->device->rs_sect_ev, 0);  /* FIXME: ??? */
 	peer_device->rs_in_flight = 0;
+	peer_device->rs_ctl_window = 0;
+	peer_device->rs_ctl_lat = 0;
+	peer_device->rs_ctl_lat_base = 0;
 	peer_device->rs_last_events =
 		drbd_backing_bdev_events(peer_device->device->ldev->backing_bdev->bd_contains->bd_disk);
 
@@ -2737,7 +2908,9 @@ static int process_sender_todo(struct drbd_connection *connection)
 	 * or requests from the transfer log.
 	 *
 	 * Right now, work items do not require any strict ordering wrt. the
-	 * request stream, so lets just do simple interleaved processing.
+	 * request stream. Requests go first, up to sender_req_batch of them
+	 * per work item, so that a resync with lots of queued replies does
+	 * not add much latency to application IO.
 	 *
 	 * Stop processing as soon as an error is encountered.
 	 */
@@ -2753,23 +2926,24 @@ static int process_sender_todo(struct drbd_connection *connection)
 	}
 
 	while (!list_empty(&connection->todo.work_list)) {
+		unsigned int n = max(DRBD_SENDER_REQ_BATCH, 1);
 		int err;
 
-		w = list_first_entry(&connection->todo.work_list, struct drbd_work, list);
-		list_del_init(&w->list);
-		update_sender_timing_details(connection, w->cb);
-		err = w->cb(w, connection->cstate[NOW] < C_CONNECTED);
-		if (err)
-			return err;
-
 		/* If we would need strict ordering for work items, we could
 		 * add a dagtag member to struct drbd_work, and serialize based on that.
 		 * && !dagtag_newer(connection->todo.req->dagtag_sector, w->dagtag_sector))
 		 * to the following condition. */
-		if (connection->todo.req) {
+		while (connection->todo.req && n--) {
 			update_sender_timing_details(connection, process_one_request);
 			err = process_one_request(connection);
+			if (err)
+				return err;
 		}
+
+		w = list_first_entry(&connection->todo.work_list, struct drbd_work, list);
+		list_del_init(&w->list);
+		update_sender_timing_details(connection, w->cb);
+		err = w->cb(w, connection->cstate[NOW] < C_CONNECTED);
 		if (err)
 			return err;
 	}
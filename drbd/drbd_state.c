@@ -749,7 +749,11 @@ static enum drbd_state_rv ___end_state_change(struct drbd_resource *resource, st
 		}
 		device->cached_state_unstable = !state_is_stable(device);
 	}
-	smp_wmb(); /* Make the NEW_CUR_UUID bit visible after the state change! */
+	/* Make the NEW_CUR_UUID bit visible after the state change!
+	 * Full barrier: pairs with inc_ap_bio_cond(), so that anyone looking
+	 * at ap_bio_cnt after this state change sees every bio that did not
+	 * see cached_susp and cached_state_unstable. */
+	smp_mb();
 
 	idr_for_each_entry(&resource->devices, device, vnr) {
 		if (test_bit(__NEW_CUR_UUID, &device->flags)) {
@@ -55,6 +55,7 @@ struct drbd_tcp_transport {
 	unsigned long flags;
 	struct socket *stream[2];
 	struct buffer rbuf[2];
+	void (*original_sk_write_space)(struct sock *sk);
 };
 
 struct dtt_listener {
@@ -95,6 +96,7 @@ static bool dtt_stream_ok(struct drbd_transport *transport, enum drbd_stream str
 static bool dtt_hint(struct drbd_transport *transport, enum drbd_stream stream, enum drbd_tr_hints hint);
 static void dtt_debugfs_show(struct drbd_transport *transport, struct seq_file *m);
 static void dtt_update_congested(struct drbd_tcp_transport *tcp_transport);
+static void dtt_write_space(struct sock *sk);
 static int dtt_add_path(struct drbd_transport *, struct drbd_path *path);
 static int dtt_remove_path(struct drbd_transport *, struct drbd_path *);
 
@@ -192,6 +194,22 @@ fail:
 	return -ENOMEM;
 }
 
+/* Queued skbs may still call sk_write_space after the socket is released.
+ * Restore the original callback before that, and wait for a running
+ * dtt_write_space() to finish, by taking sk_callback_lock. */
+static void dtt_unregister_write_space(struct drbd_tcp_transport *tcp_transport,
+				       struct socket *socket)
+{
+	struct sock *sk = socket->sk;
+
+	write_lock_bh(&sk->sk_callback_lock);
+	if (sk->sk_user_data == tcp_transport) {
+		sk->sk_write_space = tcp_transport->original_sk_write_space;
+		sk->sk_user_data = NULL;
+	}
+	write_unlock_bh(&sk->sk_callback_lock);
+}
+
 static void dtt_free_one_sock(struct socket *socket)
 {
 	if (socket) {
@@ -212,10 +230,12 @@ static void dtt_free(struct drbd_transport *transport, enum drbd_tr_free_op free
 
 	for (i = DATA_STREAM; i <= CONTROL_STREAM; i++) {
 		if (tcp_transport->stream[i]) {
+			dtt_unregister_write_space(tcp_transport, tcp_transport->stream[i]);
 			dtt_free_one_sock(tcp_transport->stream[i]);
 			tcp_transport->stream[i] = NULL;
 		}
 	}
+	clear_bit(NET_CONGESTED, &transport->flags);
 
 	for_each_path_ref(drbd_path, transport) {
 		bool was_established = drbd_path->established;
@@ -344,11 +364,16 @@ static int dtt_recv(struct drbd_transport *transport, enum drbd_stream stream, v
 	return rv;
 }
 
+/* Number of pages dtt_recv_pages() receives with one kernel_recvmsg() */
+#define DTT_RECV_PAGES_BATCH 16
+
 static int dtt_recv_pages(struct drbd_transport *transport, struct drbd_page_chain_head *chain, size_t size)
 {
 	struct drbd_tcp_transport *tcp_transport =
 		container_of(transport, struct drbd_tcp_transport, transport);
 	struct socket *socket = tcp_transport->stream[DATA_STREAM];
+	struct kvec iov[DTT_RECV_PAGES_BATCH];
+	struct page *pages[DTT_RECV_PAGES_BATCH];
 	struct page *page;
 	int err;
 
@@ -360,16 +385,40 @@ static int dtt_recv_pages(struct drbd_transport *transport, struct drbd_page_cha
 	if (!page)
 		return -ENOMEM;
 
-	page_chain_for_each(page) {
-		size_t len = min_t(int, size, PAGE_SIZE);
-		void *data = kmap(page);
-		err = dtt_recv_short(socket, data, len, 0);
-		kunmap(page);
-		set_page_chain_offset(page, 0);
-		set_page_chain_size(page, len);
-		if (err < 0)
+	/* Instead of one recvmsg per page, map a batch of pages of the
+	 * chain and receive into all of them with a single call.
+	 * kmap() of a lowmem page is just page_address(). Highmem pages take
+	 * a slot from the small, shared kmap pool; hold at most one of those
+	 * at a time, in a batch of its own. */
+	while (page) {
+		struct msghdr msg = { .msg_flags = MSG_WAITALL | MSG_NOSIGNAL };
+		size_t batch_len = 0;
+		int i, n = 0;
+
+		for (; page && n < DTT_RECV_PAGES_BATCH; page = page_chain_next(page), n++) {
+			size_t len = min_t(size_t, size, PAGE_SIZE);
+
+			if (n && (PageHighMem(page) || PageHighMem(pages[n - 1])))
+				break;
+			pages[n] = page;
+			iov[n].iov_base = kmap(page);
+			iov[n].iov_len = len;
+			set_page_chain_offset(page, 0);
+			set_page_chain_size(page, len);
+			batch_len += len;
+			size -= len;
+		}
+
+		err = kernel_recvmsg(socket, &msg, iov, n, batch_len, msg.msg_flags);
+
+		for (i = 0; i < n; i++)
+			kunmap(pages[i]);
+
+		if (err != batch_len) {
+			if (err >= 0)
+				err = -EIO;
 			goto fail;
-		size -= len;
+		}
 	}
 	return 0;
 fail:
@@ -1070,6 +1119,14 @@ randomize:
 	dtt_nodelay(dsocket);
 	dtt_nodelay(csocket);
 
+	/* NET_CONGESTED gets cleared from the write space callback, once the
+	 * peer has drained the send buffer to below the congestion limit. */
+	write_lock_bh(&dsocket->sk->sk_callback_lock);
+	tcp_transport->original_sk_write_space = dsocket->sk->sk_write_space;
+	dsocket->sk->sk_write_space = dtt_write_space;
+	dsocket->sk->sk_user_data = tcp_transport;
+	write_unlock_bh(&dsocket->sk->sk_callback_lock);
+
 	tcp_transport->stream[DATA_STREAM] = dsocket;
 	tcp_transport->stream[CONTROL_STREAM] = csocket;
 
@@ -1139,6 +1196,36 @@ static bool dtt_stream_ok(struct drbd_transport *transport, enum drbd_stream str
 	return socket && socket->sk;
 }
 
+/* Data beyond what the path can have in flight only adds latency. snd_cwnd
+ * times the MSS is TCP's own estimate of the bandwidth delay product; allow
+ * one BDP of unsent data on top of one BDP in flight. Bounded by the send
+ * buffer, so this is never stricter than sndbuf / 4 or looser than the old
+ * fixed 4/5 of the send buffer. */
+static int dtt_congestion_limit(struct sock *sk)
+{
+	struct tcp_sock *tp = tcp_sk(sk);
+	u64 bdp = (u64)tp->snd_cwnd * tp->mss_cache;
+
+	/* the result is bounded by sk_sndbuf, so it fits an int again */
+	return clamp_t(u64, 2 * bdp, sk->sk_sndbuf / 4, sk->sk_sndbuf * 4 / 5);
+}
+
+static bool dtt_below_congestion_limit(struct sock *sk)
+{
+	return sk->sk_wmem_queued <= dtt_congestion_limit(sk) / 2;
+}
+
+static void dtt_set_congested(struct drbd_tcp_transport *tcp_transport, struct socket *socket)
+{
+	/* SOCK_NOSPACE makes TCP call sk_write_space when ACKs free memory */
+	set_bit(SOCK_NOSPACE, &socket->flags);
+	set_bit(NET_CONGESTED, &tcp_transport->transport.flags);
+	smp_mb();
+	/* The buffer might have drained before SOCK_NOSPACE was set */
+	if (dtt_below_congestion_limit(socket->sk))
+		clear_bit(NET_CONGESTED, &tcp_transport->transport.flags);
+}
+
 static void dtt_update_congested(struct drbd_tcp_transport *tcp_transport)
 {
 	struct socket *socket = tcp_transport->stream[DATA_STREAM];
@@ -1148,32 +1235,59 @@ static void dtt_update_congested(struct drbd_tcp_transport *tcp_transport)
 		return;
 
 	sock = socket->sk;
-	if (sock->sk_wmem_queued > sock->sk_sndbuf * 4 / 5)
-		set_bit(NET_CONGESTED, &tcp_transport->transport.flags);
+	if (sock->sk_wmem_queued > dtt_congestion_limit(sock))
+		dtt_set_congested(tcp_transport, socket);
 }
 
-static int dtt_send_page(struct drbd_transport *transport, enum drbd_stream stream,
-			 struct page *page, int offset, size_t size, unsigned msg_flags)
+static void dtt_write_space(struct sock *sk)
+{
+	struct drbd_tcp_transport *tcp_transport;
+	void (*write_space)(struct sock *sk);
+
+	read_lock_bh(&sk->sk_callback_lock);
+	tcp_transport = sk->sk_user_data;
+	if (!tcp_transport) {
+		/* dtt_unregister_write_space() restored the original meanwhile */
+		write_space = sk->sk_write_space;
+		read_unlock_bh(&sk->sk_callback_lock);
+		if (write_space != dtt_write_space)
+			write_space(sk);
+		return;
+	}
+
+	tcp_transport->original_sk_write_space(sk);
+
+	if (test_bit(NET_CONGESTED, &tcp_transport->transport.flags)) {
+		if (dtt_below_congestion_limit(sk))
+			clear_bit(NET_CONGESTED, &tcp_transport->transport.flags);
+		else if (sk->sk_socket)
+			/* The original callback clears it once the socket is writeable,
+			 * but our limit may be lower than that. Keep the callbacks coming. */
+			set_bit(SOCK_NOSPACE, &sk->sk_socket->flags);
+	}
+	read_unlock_bh(&sk->sk_callback_lock);
+}
+
+/* The caller has to take care of set_fs() and of checking for congestion.
+ * That way, dtt_send_zc_bio() does not have to repeat it for each page. */
+static int __dtt_send_page(struct drbd_transport *transport, enum drbd_stream stream,
+			   struct socket *socket, struct page *page, int offset,
+			   size_t size, unsigned msg_flags)
 {
 	struct drbd_tcp_transport *tcp_transport =
 		container_of(transport, struct drbd_tcp_transport, transport);
-	struct socket *socket = tcp_transport->stream[stream];
-	mm_segment_t oldfs = get_fs();
 	int len = size;
 	int err = -EIO;
 
-	if (!socket)
-		return -ENOTCONN;
-
 	msg_flags |= MSG_NOSIGNAL;
-	dtt_update_congested(tcp_transport);
-	set_fs(KERNEL_DS);
 	do {
 		int sent;
 
 		sent = socket->ops->sendpage(socket, page, offset, len, msg_flags);
 		if (sent <= 0) {
 			if (sent == -EAGAIN) {
+				if (stream == DATA_STREAM)
+					dtt_set_congested(tcp_transport, socket);
 				if (drbd_stream_send_timed_out(transport, stream))
 					break;
 				continue;
@@ -1187,8 +1301,6 @@ static int dtt_send_page(struct drbd_transport *transport, enum drbd_stream stre
 		len    -= sent;
 		offset += sent;
 	} while (len > 0 /* THINK && peer_device->repl_state[NOW] >= L_ESTABLISHED */);
-	set_fs(oldfs);
-	clear_bit(NET_CONGESTED, &tcp_transport->transport.flags);
 
 	if (len == 0)
 		err = 0;
@@ -1196,24 +1308,57 @@ static int dtt_send_page(struct drbd_transport *transport, enum drbd_stream stre
 	return err;
 }
 
+static int dtt_send_page(struct drbd_transport *transport, enum drbd_stream stream,
+			 struct page *page, int offset, size_t size, unsigned msg_flags)
+{
+	struct drbd_tcp_transport *tcp_transport =
+		container_of(transport, struct drbd_tcp_transport, transport);
+	struct socket *socket = tcp_transport->stream[stream];
+	mm_segment_t oldfs = get_fs();
+	int err;
+
+	if (!socket)
+		return -ENOTCONN;
+
+	dtt_update_congested(tcp_transport);
+	set_fs(KERNEL_DS);
+	err = __dtt_send_page(transport, stream, socket, page, offset, size, msg_flags);
+	set_fs(oldfs);
+
+	return err;
+}
+
 static int dtt_send_zc_bio(struct drbd_transport *transport, struct bio *bio)
 {
+	struct drbd_tcp_transport *tcp_transport =
+		container_of(transport, struct drbd_tcp_transport, transport);
+	struct socket *socket = tcp_transport->stream[DATA_STREAM];
+	mm_segment_t oldfs = get_fs();
 	DRBD_BIO_VEC_TYPE bvec;
 	DRBD_ITER_TYPE iter;
+	int err = 0;
 
-	bio_for_each_segment(bvec, bio, iter) {
-		int err;
+	if (!socket)
+		return -ENOTCONN;
 
-		err = dtt_send_page(transport, DATA_STREAM, bvec BVD bv_page,
+	/* The header went out with MSG_MORE already, and so do all but the
+	 * last segment: TCP builds full sized segments from them anyways.
+	 * Checking for congestion once per bio is good enough. */
+	dtt_update_congested(tcp_transport);
+	set_fs(KERNEL_DS);
+	bio_for_each_segment(bvec, bio, iter) {
+		err = __dtt_send_page(transport, DATA_STREAM, socket, bvec BVD bv_page,
 				      bvec BVD bv_offset, bvec BVD bv_len,
 				      bio_iter_last(bvec, iter) ? 0 : MSG_MORE);
 		if (err)
-			return err;
+			break;
 
 		if (bio_op(bio) == REQ_OP_WRITE_SAME)
 			break;
 	}
-	return 0;
+	set_fs(oldfs);
+
+	return err;
 }
 
 static void dtt_cork(struct socket *socket)
@@ -1280,6 +1425,7 @@ static void dtt_debugfs_show_stream(struct seq_file *m, struct socket *socket)
 		   tp->write_seq - tp->snd_una);
 	seq_printf(m, "send buffer size: %u Byte\n", sk->sk_sndbuf);
 	seq_printf(m, "send buffer used: %u Byte\n", sk->sk_wmem_queued);
+	seq_printf(m, "congestion limit: %d Byte\n", dtt_congestion_limit(sk));
 }
 
 static void dtt_debugfs_show(struct drbd_transport *transport, struct seq_file *m)
@@ -1289,7 +1435,7 @@ static void dtt_debugfs_show(struct drbd_transport *transport, struct seq_file *
 	enum drbd_stream i;
 
 	/* BUMP me if you change the file format/content/presentation */
-	seq_printf(m, "v: %u\n\n", 0);
+	seq_printf(m, "v: %u\n\n", 1);
 
 	for (i = DATA_STREAM; i <= CONTROL_STREAM ; i++) {
 		struct socket *socket = tcp_transport->stream[i];